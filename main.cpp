@@ -2,11 +2,19 @@
 #include <fstream>
 #include <vector>
 #include <cstring>
+#include <cstddef>
+#include <type_traits>
 #include <cmath>
 #include <queue>
 #include <utility>
 #include <random>
 #include <chrono>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <atomic>
+#include <iomanip>
 
 using namespace std;
 
@@ -17,7 +25,135 @@ mt19937 rng(chrono::steady_clock::now().time_since_epoch().count());
 #define MV_VOID(x, y) (((uint8_t*)(x))+(y))
 
 
-const uint32_t PAGE_SIZE = 4096;
+// Tracing, compiled in with -DDB2_TRACE. Every thread records the spans it closes into its own ring buffer without
+// taking a lock, and dumpTrace() writes them out as Chrome trace JSON (chrome://tracing or ui.perfetto.dev).
+#ifdef DB2_TRACE
+const uint32_t TRACE_RING_EVENTS = 1 << 16; // Per thread, older events are overwritten
+
+const chrono::steady_clock::time_point traceEpoch = chrono::steady_clock::now();
+
+uint64_t traceNow() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// "seq" is odd while the slot is written and 2 * (event number + 1) afterwards, so a reader can tell a torn slot
+class TraceEvent {
+public:
+    atomic<uint64_t> seq{0};
+    atomic<const char*> name{nullptr};
+    atomic<uint64_t> start{0}; // ns since traceEpoch
+    atomic<uint64_t> duration{0};
+    atomic<uint32_t> threadId{0};
+};
+
+class TraceRing {
+public:
+    TraceEvent events[TRACE_RING_EVENTS];
+    atomic<uint64_t> head{0}; // Number of events recorded so far, only advanced by the owning thread
+
+    void record(const char* name, uint64_t start, uint64_t duration, uint32_t threadId) {
+        uint64_t h = head.load(memory_order_relaxed);
+        TraceEvent& e = events[h % TRACE_RING_EVENTS];
+        e.seq.store(2 * h + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        e.name.store(name, memory_order_relaxed);
+        e.start.store(start, memory_order_relaxed);
+        e.duration.store(duration, memory_order_relaxed);
+        e.threadId.store(threadId, memory_order_relaxed);
+        e.seq.store(2 * h + 2, memory_order_release);
+        head.store(h + 1, memory_order_release);
+    }
+};
+
+// Rings are registered once per thread. The ring of a finished thread is handed to the next new one, and its old
+// events stay readable until they are overwritten. The registry is never destroyed, as threads may still finish
+// while the program exits.
+mutex& traceLock = *new mutex();
+vector<TraceRing*>& traceRings = *new vector<TraceRing*>();
+vector<TraceRing*>& traceFreeRings = *new vector<TraceRing*>();
+uint32_t traceThreadCount = 0;
+
+class TraceThread {
+public:
+    TraceRing* ring;
+    uint32_t threadId;
+
+    TraceThread() {
+        lock_guard<mutex> guard(traceLock);
+        if(traceFreeRings.size()) {
+            ring = traceFreeRings.back();
+            traceFreeRings.pop_back();
+        }
+        else {
+            ring = new TraceRing();
+            traceRings.push_back(ring);
+        }
+        threadId = traceThreadCount++;
+    }
+    ~TraceThread() {
+        lock_guard<mutex> guard(traceLock);
+        traceFreeRings.push_back(ring);
+    }
+};
+thread_local TraceThread traceThread;
+
+class TraceSpan {
+public:
+    const char* name;
+    uint64_t start;
+
+    TraceSpan(const char* spanName) {
+        name = spanName;
+        start = traceNow();
+    }
+    ~TraceSpan() {
+        traceThread.ring->record(name, start, traceNow() - start, traceThread.threadId);
+    }
+};
+
+// Writes the events still held by the rings as complete ("X") events. Threads may keep recording meanwhile.
+void dumpTrace(const string& path) {
+    ofstream out(path);
+    out << "{\"traceEvents\":[";
+    out << fixed << setprecision(3);
+    bool first = true;
+
+    lock_guard<mutex> guard(traceLock);
+    for(auto ring : traceRings) {
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for(uint64_t h = head - min<uint64_t>(head, TRACE_RING_EVENTS); h < head; ++h) {
+            TraceEvent& e = ring->events[h % TRACE_RING_EVENTS];
+            uint64_t seq = e.seq.load(memory_order_acquire);
+            const char* name = e.name.load(memory_order_relaxed);
+            uint64_t start = e.start.load(memory_order_relaxed);
+            uint64_t duration = e.duration.load(memory_order_relaxed);
+            uint32_t threadId = e.threadId.load(memory_order_relaxed);
+            atomic_thread_fence(memory_order_acquire);
+            if(seq != 2 * h + 2 || e.seq.load(memory_order_relaxed) != seq)
+                continue; // Overwritten since "head" was read
+
+            out << (first ? "\n" : ",\n");
+            out << "{\"name\":\"" << name << "\",\"cat\":\"db2\",\"ph\":\"X\",\"ts\":" << start / 1000.0
+                << ",\"dur\":" << duration / 1000.0 << ",\"pid\":1,\"tid\":" << threadId << "}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Records the time until the end of the enclosing scope under "name", which has to be a string literal
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name)
+#else
+#define TRACE_SPAN(name)
+#endif
+
+
+// The page size is chosen when a file is created and recorded in its header
+const uint32_t DEFAULT_PAGE_SIZE = 4096;
+const uint32_t LEGACY_PAGE_SIZE = 4096; // Files written before the header existed
+const uint32_t MIN_PAGE_SIZE = 4096;
 const uint32_t MAX_PAGES = 1000;
 const uint32_t MAX_TABLES = 100;
 
@@ -34,10 +170,27 @@ const uint32_t NUM_CELL_SIZE = sizeof(uint32_t);
 const uint32_t HEADER_SIZE = NUM_CELL_SIZE + NUM_CELL_OFFSET;
 
 const uint32_t BODY_OFFSET = HEADER_SIZE;
-const uint32_t BODY_SIZE = PAGE_SIZE - HEADER_SIZE;
+
+// Write-optimized mode: the end of an internal page holds a buffer of pending messages,
+// [count][bytes][op, row or key]... An insert carries the row, a delete only the key.
+const uint32_t MESSAGE_COUNT_SIZE = sizeof(uint32_t);
+const uint32_t MESSAGE_BYTES_SIZE = sizeof(uint32_t);
+const uint32_t MESSAGE_HEADER_SIZE = MESSAGE_COUNT_SIZE + MESSAGE_BYTES_SIZE;
+const uint32_t MESSAGE_OP_SIZE = sizeof(uint8_t);
+const uint8_t MESSAGE_INSERT = 1;
+const uint8_t MESSAGE_DELETE = 2;
+const uint32_t MESSAGE_BUFFER_PERCENT = 90; // Share of the page body given to the buffer
+const uint32_t MIN_BUFFERED_PAGE_SIZE = 16384; // Smaller pages buffer too few rows to batch anything
 
 const uint32_t TABLE_NUM = 0;
-const uint32_t INTERNAL_CELL_SIZE = sizeof(uint64_t);
+
+// A pointer cell of a resident internal node may hold the child's frame address instead of its page number.
+// Page numbers and user-space addresses never use the top bit, so it tags the cell as swizzled.
+const uint64_t SWIZZLE_TAG = 1ULL << 63;
+
+// Marks a file that starts with a header. The header takes up a whole page in front of page 0, so pages stay aligned to their size.
+const uint32_t FILE_MAGIC = 0x00324244; // "DB2\0"; never a valid first byte of a page
+const uint32_t FILE_FLAG_BUFFERED_WRITES = 1;
 
 const uint32_t LEN = 255;
 
@@ -56,15 +209,146 @@ public:
     char email[LEN];
 };
 
-const uint32_t ROW_SIZE = sizeof(Row);
-const uint32_t MAX_LEAF_ROWS = BODY_SIZE / ROW_SIZE - 1;
-const uint32_t MIN_LEAF_ROWS = ceil((double)MAX_LEAF_ROWS / 2);
-const uint32_t MAX_INTERNAL_ROWS = BODY_SIZE / INTERNAL_CELL_SIZE - 2 - ((BODY_SIZE / INTERNAL_CELL_SIZE) % 2 == 0);
-const uint32_t MAX_INTERNAL_KEYS = MAX_INTERNAL_ROWS / 2;
-const uint32_t MIN_INTERNAL_KEYS = MAX_INTERNAL_KEYS / 2;
-const uint32_t MIN_INTERNAL_ROWS = 2 * (MIN_INTERNAL_KEYS) + 1;
+class Session {
+public:
+    char token[32];
+    int64_t userId;
+    int64_t expiresAt;
+};
+
+// Fixed-width string key, ordered bytewise. Unused trailing bytes have to be zero.
+template<uint32_t N>
+class FixedKey {
+public:
+    char data[N];
+
+    bool operator<(const FixedKey& other) const { return memcmp(data, other.data, N) < 0; }
+    bool operator>(const FixedKey& other) const { return memcmp(data, other.data, N) > 0; }
+    bool operator<=(const FixedKey& other) const { return memcmp(data, other.data, N) <= 0; }
+    bool operator>=(const FixedKey& other) const { return memcmp(data, other.data, N) >= 0; }
+    bool operator==(const FixedKey& other) const { return memcmp(data, other.data, N) == 0; }
+    bool operator!=(const FixedKey& other) const { return memcmp(data, other.data, N) != 0; }
+};
+template<uint32_t N>
+ostream& operator<<(ostream& os, const FixedKey<N>& key) {
+    return os << string(key.data, strnlen(key.data, N));
+}
+
+// A schema describes the rows of a table: the row type, the key type (whose operators order the tree) and where
+// the key is stored in a row. Everything else about the page layout is derived from it at compile time.
+class UserSchema {
+public:
+    using Row = ::Row;
+    using Key = int64_t;
+    static constexpr uint32_t KEY_OFFSET = offsetof(Row, id);
+    static_assert(sizeof(Key) == size_of_attribute(Row, id), "the key has to cover the id column");
+
+    static Key key(const Row& row) { return row.id; }
+    static void print(const Row& row) {
+        cout << "( " << row.id << ", " << row.name << ", " << row.email << " )\n";
+    }
+};
 
-void printConstants() {
+class SessionSchema {
+public:
+    using Row = Session;
+    using Key = FixedKey<32>;
+    static constexpr uint32_t KEY_OFFSET = offsetof(Row, token);
+    static_assert(sizeof(Key) == size_of_attribute(Row, token), "the key has to cover the token column");
+
+    static Key key(const Row& row) {
+        Key key;
+        memcpy(key.data, row.token, sizeof(Key));
+        return key;
+    }
+    static void print(const Row& row) {
+        cout << "( " << key(row) << ", " << row.userId << ", " << row.expiresAt << " )\n";
+    }
+};
+
+class FileHeader {
+public:
+    uint32_t magic;
+    uint32_t pageSize;
+    uint32_t flags;
+};
+
+bool isValidPageSize(uint32_t pageSize) {
+    return pageSize == 4096 || pageSize == 8192 || pageSize == 16384 || pageSize == 65536;
+}
+
+// Page layout of a schema. Internal nodes alternate pointer and key cells, so a cell fits either of them.
+// The node capacities depend on the page size of the file.
+template<class Schema>
+class Layout {
+public:
+    using Row = typename Schema::Row;
+    using Key = typename Schema::Key;
+
+    static constexpr uint32_t ROW_SIZE = sizeof(Row);
+    static constexpr uint32_t KEY_OFFSET = Schema::KEY_OFFSET;
+    static constexpr uint32_t KEY_SIZE = sizeof(Key);
+    static constexpr uint32_t INTERNAL_CELL_SIZE = max<uint32_t>(sizeof(Key), sizeof(uint64_t));
+    static constexpr uint32_t MESSAGE_SIZE = MESSAGE_OP_SIZE + ROW_SIZE;
+
+    static constexpr uint32_t maxLeafRows(uint32_t pageSize) {
+        return (pageSize - HEADER_SIZE) / ROW_SIZE - 1;
+    }
+    static constexpr uint32_t minLeafRows(uint32_t pageSize) {
+        return (maxLeafRows(pageSize) + 1) / 2;
+    }
+    // Number of inserts a buffer holds. Deletes take less room.
+    static constexpr uint32_t maxMessages(uint32_t pageSize) {
+        return ((pageSize - HEADER_SIZE) * MESSAGE_BUFFER_PERCENT / 100 - MESSAGE_HEADER_SIZE) / MESSAGE_SIZE;
+    }
+    static constexpr uint32_t messageCapacity(uint32_t pageSize) {
+        return maxMessages(pageSize) * MESSAGE_SIZE;
+    }
+    static constexpr uint32_t messageBufferSize(uint32_t pageSize) {
+        return MESSAGE_HEADER_SIZE + messageCapacity(pageSize);
+    }
+    // About the square root of the buffer size, so that a flush moves several messages to the same child
+    static constexpr uint32_t maxBufferedKeys(uint32_t pageSize) {
+        uint32_t keys = 2;
+        while((keys + 1) * (keys + 1) <= maxMessages(pageSize)) ++keys;
+        return keys;
+    }
+    // Internal nodes of a write-optimized file trade fanout for the buffer
+    static constexpr uint32_t maxInternalRows(uint32_t pageSize, bool bufferedWrites = false) {
+        uint32_t cells = (pageSize - HEADER_SIZE - (bufferedWrites ? messageBufferSize(pageSize) : 0)) / INTERNAL_CELL_SIZE;
+        uint32_t rows = cells - 2 - (cells % 2 == 0);
+        if(bufferedWrites)
+            rows = min(rows, 2 * maxBufferedKeys(pageSize) + 1);
+        return rows;
+    }
+    static constexpr uint32_t maxInternalKeys(uint32_t pageSize, bool bufferedWrites = false) {
+        return maxInternalRows(pageSize, bufferedWrites) / 2;
+    }
+    static constexpr uint32_t minInternalKeys(uint32_t pageSize, bool bufferedWrites = false) {
+        return maxInternalKeys(pageSize, bufferedWrites) / 2;
+    }
+
+    static_assert(is_trivially_copyable<Row>::value, "rows are copied with memcpy");
+    static_assert(KEY_OFFSET + KEY_SIZE <= ROW_SIZE, "the key has to lie inside the row");
+};
+
+// Number of consecutive increasing keys after which inserts are treated as appends
+const uint32_t APPEND_RUN_THRESHOLD = 4;
+// Share of an overflowing internal node kept on the left when it is split by an append
+const double APPEND_INTERNAL_SPLIT_RATIO = 0.9;
+
+// Share of a node filled by the online reorganization, and the number of source leaves it copies per step
+const double VACUUM_FILL_FACTOR = 0.9;
+const uint32_t VACUUM_STEP_LEAVES = 16;
+
+// Sizing of the optional key filter. About 10 counters per key and 4 probes give roughly 1% false positives.
+const uint32_t KEY_FILTER_SLOTS_PER_KEY = 10;
+const uint32_t KEY_FILTER_HASHES = 4;
+const uint32_t KEY_FILTER_MIN_KEYS = 1024;
+
+template<class Schema>
+void printConstants(uint32_t pageSize, bool bufferedWrites) {
+    using L = Layout<Schema>;
     cout << "\n";
     cout << "IS_LEAF_OFFSET = " << IS_LEAF_OFFSET << "\n";
     cout << "IS_LEAF_SIZE = " << IS_LEAF_SIZE << "\n";
@@ -76,37 +360,160 @@ void printConstants() {
     cout << "NUM_CELL_SIZE = " << NUM_CELL_SIZE << "\n";
     cout << "HEADER_SIZE = " << HEADER_SIZE << "\n";
     cout << "BODY_OFFSET = " << BODY_OFFSET << "\n";
-    cout << "BODY_SIZE = " << BODY_SIZE << "\n";
-    cout << "INTERNAL_CELL_SIZE = " << INTERNAL_CELL_SIZE << "\n";
-    cout << "ROW_SIZE = " << ROW_SIZE << "\n";
-    cout << "MAX_LEAF_ROWS = " << MAX_LEAF_ROWS << "\n";
-    cout << "MIN_LEAF_ROWS = " << MIN_LEAF_ROWS << "\n";
-    cout << "MAX_INTERNAL_ROWS = " << MAX_INTERNAL_ROWS << "\n";
-    cout << "MAX_INTERNAL_KEYS = " << MAX_INTERNAL_KEYS << "\n";
-    cout << "MIN_INTERNAL_KEYS = " << MIN_INTERNAL_KEYS << "\n";
-    cout << "MIN_INTERNAL_ROWS = " << MIN_INTERNAL_ROWS << "\n";
+    cout << "PAGE_SIZE = " << pageSize << "\n";
+    cout << "BODY_SIZE = " << pageSize - HEADER_SIZE << "\n";
+    cout << "INTERNAL_CELL_SIZE = " << L::INTERNAL_CELL_SIZE << "\n";
+    cout << "ROW_SIZE = " << L::ROW_SIZE << "\n";
+    cout << "MAX_LEAF_ROWS = " << L::maxLeafRows(pageSize) << "\n";
+    cout << "MIN_LEAF_ROWS = " << L::minLeafRows(pageSize) << "\n";
+    cout << "MAX_INTERNAL_ROWS = " << L::maxInternalRows(pageSize, bufferedWrites) << "\n";
+    cout << "MAX_INTERNAL_KEYS = " << L::maxInternalKeys(pageSize, bufferedWrites) << "\n";
+    cout << "MIN_INTERNAL_KEYS = " << L::minInternalKeys(pageSize, bufferedWrites) << "\n";
+    cout << "MIN_INTERNAL_ROWS = " << 2 * L::minInternalKeys(pageSize, bufferedWrites) + 1 << "\n";
+    if(bufferedWrites)
+        cout << "MAX_MESSAGES = " << L::maxMessages(pageSize) << "\n";
     // cout << " = " <<  << "\n";
     cout << "\n";
 }
 
-class PageNode {
+// Partial aggregate of a scan. Every worker of a parallel scan fills its own and they are merged at the end.
+template<class Schema>
+class ScanResult {
+public:
+    using Row = typename Schema::Row;
+    using Key = typename Schema::Key;
+
+    uint64_t count = 0; // Rows that matched the predicate
+    Key minKey{};
+    Key maxKey{};
+    int64_t sumKeys = 0; // Only kept for integer keys
+
+    void add(const Row& row) {
+        Key key = Schema::key(row);
+        if(count == 0 || key < minKey) minKey = key;
+        if(count == 0 || key > maxKey) maxKey = key;
+        if constexpr (is_integral<Key>::value) sumKeys += key;
+        ++count;
+    }
+    void merge(const ScanResult& other) {
+        if(other.count == 0) return;
+        if(count == 0 || other.minKey < minKey) minKey = other.minKey;
+        if(count == 0 || other.maxKey > maxKey) maxKey = other.maxKey;
+        sumKeys += other.sumKeys;
+        count += other.count;
+    }
+};
+
+// Counting Bloom filter over the keys of a table. It only tracks keys, not where they live, so splits, merges
+// and borrows never affect it. Counters instead of bits let deletes remove keys again; a saturated counter stays put.
+template<class Key>
+class KeyFilter {
+public:
+    vector<uint8_t> counters;
+    uint64_t keyCount = 0;
+    uint64_t capacity = 0;
+
+    void reset(uint64_t expectedKeys) {
+        capacity = max<uint64_t>(expectedKeys, KEY_FILTER_MIN_KEYS);
+        counters.assign(capacity * KEY_FILTER_SLOTS_PER_KEY, 0);
+        keyCount = 0;
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ULL;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+    static uint64_t hash(const Key& key) {
+        if constexpr (is_integral<Key>::value) {
+            return mix(key);
+        }
+        else {
+            uint64_t h = 0xcbf29ce484222325ULL;
+            const uint8_t* bytes = (const uint8_t*)&key;
+            for(size_t i=0;i<sizeof(Key);++i) {
+                h = (h ^ bytes[i]) * 0x100000001b3ULL;
+            }
+            return mix(h);
+        }
+    }
+    // Counter probed by the i-th hash, using double hashing
+    uint64_t slot(uint64_t hash, uint32_t i) {
+        return ((hash & 0xffffffffULL) + i * ((hash >> 32) | 1)) % counters.size();
+    }
+
+    void add(const Key& key) {
+        uint64_t hash = KeyFilter::hash(key);
+        for(uint32_t i=0;i<KEY_FILTER_HASHES;++i) {
+            uint8_t &c = counters[slot(hash, i)];
+            if(c < UINT8_MAX) ++c;
+        }
+        ++keyCount;
+    }
+    void remove(const Key& key) {
+        uint64_t hash = KeyFilter::hash(key);
+        for(uint32_t i=0;i<KEY_FILTER_HASHES;++i) {
+            uint8_t &c = counters[slot(hash, i)];
+            if(c > 0 && c < UINT8_MAX) --c;
+        }
+        --keyCount;
+    }
+    // false means the key is certainly not in the table
+    bool mayContain(const Key& key) {
+        uint64_t hash = KeyFilter::hash(key);
+        for(uint32_t i=0;i<KEY_FILTER_HASHES;++i) {
+            if(counters[slot(hash, i)] == 0) return false;
+        }
+        return true;
+    }
+};
+
+template<class Schema>
+class PageNode : public Layout<Schema> {
 public:
+    using Row = typename Schema::Row;
+    using Key = typename Schema::Key;
+    using Layout<Schema>::ROW_SIZE;
+    using Layout<Schema>::KEY_OFFSET;
+    using Layout<Schema>::KEY_SIZE;
+    using Layout<Schema>::INTERNAL_CELL_SIZE;
+    using Layout<Schema>::MESSAGE_SIZE;
+
     void *page;
+    int32_t pageNumber; // In-memory only, used to unswizzle pointers to this frame
+    uint32_t pageSize;
 
 
     void* getLeafRowByteOffset(int index) {
         return MV_VOID(page, index * ROW_SIZE + BODY_OFFSET);
     }
     void* getInternalRowByteOffset(int index) {
-        return MV_VOID(page, index * sizeof(int64_t) + BODY_OFFSET);
+        return MV_VOID(page, index * INTERNAL_CELL_SIZE + BODY_OFFSET);
+    }
+
+    void* getMessageBufferByteOffset() {
+        return MV_VOID(page, pageSize - Layout<Schema>::messageBufferSize(pageSize));
+    }
+    // Messages have different sizes, so they are addressed by their byte offset in the buffer
+    void* getMessageByteOffset(uint32_t offset) {
+        return MV_VOID(getMessageBufferByteOffset(), MESSAGE_HEADER_SIZE + offset);
+    }
+
+    PageNode(int32_t number, uint32_t size) {
+        pageNumber = number;
+        pageSize = size;
+        page = operator new(pageSize);
+        reset();
     }
 
-    PageNode() {
-        page = operator new(PAGE_SIZE);
+    void reset() {
         setNumRows(0);
         setParent(-1);
         setIsLeaf(0);
         setNext(-1);
+        setMessageCount(0);
+        setMessageBytes(0);
     }
 
     void setIsLeaf(uint8_t status) {
@@ -148,8 +555,11 @@ public:
         memcpy(&val, getLeafRowByteOffset(rowNum), ROW_SIZE);
         return val;
     }
-    int64_t getLeafKey(int rowNum) {
-        return getLeafRow(rowNum).id;
+    // Reads the key in place instead of copying the whole row
+    Key getLeafKey(int rowNum) {
+        Key key;
+        memcpy(&key, MV_VOID(getLeafRowByteOffset(rowNum), KEY_OFFSET), KEY_SIZE);
+        return key;
     }
     void copyLeafRow(int src, int dest) {
         memcpy(getLeafRowByteOffset(dest), getLeafRowByteOffset(src), ROW_SIZE);
@@ -159,29 +569,61 @@ public:
     }
 
 
-    int64_t getInternalKey(int index) {
-        return *(int64_t*)MV_VOID(page, index * INTERNAL_CELL_SIZE + BODY_OFFSET);
+    Key getInternalKey(int index) {
+        Key key;
+        memcpy(&key, getInternalRowByteOffset(index), KEY_SIZE);
+        return key;
     }
     uint64_t getInternalPointer(int index) {
-        return *(uint64_t*)MV_VOID(page, index * INTERNAL_CELL_SIZE + BODY_OFFSET);
+        uint64_t ptr;
+        memcpy(&ptr, getInternalRowByteOffset(index), sizeof(uint64_t));
+        if(ptr & SWIZZLE_TAG)
+            return ((PageNode*)(ptr & ~SWIZZLE_TAG))->pageNumber;
+        return ptr;
     }
-    void setInternalKey(int index, int64_t key) {
-        *(int64_t*)MV_VOID(page, index * INTERNAL_CELL_SIZE + BODY_OFFSET) = key;
+    void setInternalKey(int index, const Key& key) {
+        memcpy(getInternalRowByteOffset(index), &key, KEY_SIZE);
     }
     void setInternalPointer(int index, uint64_t ptr) {
-        *(uint64_t*)MV_VOID(page, index * INTERNAL_CELL_SIZE + BODY_OFFSET) = ptr;
+        memcpy(getInternalRowByteOffset(index), &ptr, sizeof(uint64_t));
+    }
+    // Returns the resident frame of the child at "index", or nullptr if the cell still holds a page number
+    PageNode* getChild(int index) {
+        uint64_t ptr;
+        memcpy(&ptr, getInternalRowByteOffset(index), sizeof(uint64_t));
+        if(ptr & SWIZZLE_TAG)
+            return (PageNode*)(ptr & ~SWIZZLE_TAG);
+        return nullptr;
+    }
+    void swizzleChild(int index, PageNode* child) {
+        setInternalPointer(index, (uint64_t)child | SWIZZLE_TAG);
+    }
+    // Replace every frame address with its page number so that the page can be written to disk
+    void unswizzle() {
+        if(isLeaf()) return;
+        int len = size();
+        for(int i=0;i<len;i+=2) {
+            setInternalPointer(i, getInternalPointer(i));
+        }
     }
     void copyInternalCell(int src, int dest) {
-        setInternalKey(dest, getInternalKey(src));
+        memcpy(getInternalRowByteOffset(dest), getInternalRowByteOffset(src), INTERNAL_CELL_SIZE);
     }
-    void insertInternalCell(int index, int64_t value) {
+    void insertInternalCell(int index) {
         int len = size();
         for(int i=len-1;i>=index;--i) {
             copyInternalCell(i, i+1);
         }
-        setInternalKey(index, value);
         setNumRows(len + 1);
     }
+    void insertInternalKey(int index, const Key& key) {
+        insertInternalCell(index);
+        setInternalKey(index, key);
+    }
+    void insertInternalPointer(int index, uint64_t ptr) {
+        insertInternalCell(index);
+        setInternalPointer(index, ptr);
+    }
     void eraseInternalCell(int index) {
         int len = size();
         for(int i=index; i<len-1; ++i) {
@@ -194,6 +636,61 @@ public:
         return size() / 2;
     }
 
+    // Message buffer, only used by internal nodes of a write-optimized file. Messages are kept oldest first.
+    static uint32_t messageSize(uint8_t op) {
+        return MESSAGE_OP_SIZE + (op == MESSAGE_DELETE ? KEY_SIZE : ROW_SIZE);
+    }
+    void setMessageCount(uint32_t count) {
+        memcpy(getMessageBufferByteOffset(), &count, MESSAGE_COUNT_SIZE);
+    }
+    uint32_t messageCount() {
+        uint32_t count;
+        memcpy(&count, getMessageBufferByteOffset(), MESSAGE_COUNT_SIZE);
+        return count;
+    }
+    void setMessageBytes(uint32_t bytes) {
+        memcpy(MV_VOID(getMessageBufferByteOffset(), MESSAGE_COUNT_SIZE), &bytes, MESSAGE_BYTES_SIZE);
+    }
+    uint32_t messageBytes() {
+        uint32_t bytes;
+        memcpy(&bytes, MV_VOID(getMessageBufferByteOffset(), MESSAGE_COUNT_SIZE), MESSAGE_BYTES_SIZE);
+        return bytes;
+    }
+    uint8_t getMessageOp(uint32_t offset) {
+        uint8_t op;
+        memcpy(&op, getMessageByteOffset(offset), MESSAGE_OP_SIZE);
+        return op;
+    }
+    // Only the key is set for a delete
+    Row getMessageRow(uint32_t offset) {
+        Row row = Row();
+        if(getMessageOp(offset) == MESSAGE_DELETE)
+            memcpy(MV_VOID(&row, KEY_OFFSET), MV_VOID(getMessageByteOffset(offset), MESSAGE_OP_SIZE), KEY_SIZE);
+        else
+            memcpy(&row, MV_VOID(getMessageByteOffset(offset), MESSAGE_OP_SIZE), ROW_SIZE);
+        return row;
+    }
+    Key getMessageKey(uint32_t offset) {
+        Key key;
+        uint32_t keyOffset = MESSAGE_OP_SIZE + (getMessageOp(offset) == MESSAGE_DELETE ? 0 : KEY_OFFSET);
+        memcpy(&key, MV_VOID(getMessageByteOffset(offset), keyOffset), KEY_SIZE);
+        return key;
+    }
+    // Moves a message towards the front of the buffer
+    void moveMessage(uint32_t src, uint32_t dest) {
+        memmove(getMessageByteOffset(dest), getMessageByteOffset(src), messageSize(getMessageOp(src)));
+    }
+    void appendMessage(uint8_t op, const Row& row) {
+        uint32_t bytes = messageBytes();
+        memcpy(getMessageByteOffset(bytes), &op, MESSAGE_OP_SIZE);
+        if(op == MESSAGE_DELETE)
+            memcpy(MV_VOID(getMessageByteOffset(bytes), MESSAGE_OP_SIZE), MV_VOID(&row, KEY_OFFSET), KEY_SIZE);
+        else
+            memcpy(MV_VOID(getMessageByteOffset(bytes), MESSAGE_OP_SIZE), &row, ROW_SIZE);
+        setMessageCount(messageCount() + 1);
+        setMessageBytes(bytes + messageSize(op));
+    }
+
     void initializeLeafNode() {
         setParent(-1);
         setNext(-1);
@@ -210,8 +707,18 @@ public:
 
 
 
-class Table {
+template<class Schema>
+class Table : public Layout<Schema> {
 public:
+    using Row = typename Schema::Row;
+    using Key = typename Schema::Key;
+    using PageNode = ::PageNode<Schema>;
+    using ScanResult = ::ScanResult<Schema>;
+    using Layout<Schema>::ROW_SIZE;
+    using Layout<Schema>::INTERNAL_CELL_SIZE;
+    static_assert(Layout<Schema>::maxLeafRows(MIN_PAGE_SIZE) >= 2, "a leaf has to hold at least two rows");
+    static_assert(Layout<Schema>::maxMessages(MIN_BUFFERED_PAGE_SIZE) >= 16, "a buffer has to hold enough rows to batch them");
+
     string name;
     vector<PageNode*> pages;
     int32_t root;
@@ -219,31 +726,208 @@ public:
     string filename;
     int32_t page_count;
 
-    Table(char* fn) {
+    // Page size of the file and the node capacities that follow from it
+    uint32_t pageSize;
+    int64_t dataOffset; // File offset of page 0
+    uint32_t maxLeafRows, minLeafRows;
+    uint32_t maxInternalRows, maxInternalKeys, minInternalKeys;
+
+    // Write-optimized mode, chosen when the file is created. See bufferMessage().
+    bool bufferedWrites;
+    uint32_t messageCapacity; // Bytes
+    uint64_t shapeVersion;    // Bumped by every split, merge, borrow and root change, see flushNode()
+    uint64_t heightVersion;   // Shape version "cachedHeight" was computed at
+    int cachedHeight;         // Height of the root above the leaves, see rootHeight()
+
+    // Loading a page is guarded for parallel scans. A resident page is found without the lock: its flag is set
+    // after the frame is in place.
+    mutex pageLock;
+    vector<atomic<uint8_t>> resident;
+
+    int32_t lastLeaf;      // Leaf that received the previous insert, -1 if unknown
+    Key lastInsertKey;
+    uint32_t appendRun;    // Number of consecutive inserts with increasing keys
+
+    // Pages below page_count that are no longer part of the tree and can be handed out again
+    vector<uint8_t> freePage;
+    int32_t freeCount;
+
+    // Online reorganization, see vacuumStep()
+    bool vacuumActive;
+    bool vacuumHasKey;
+    Key vacuumLastKey;  // Every key up to this one has been copied into the rebuilt leaves
+    double vacuumFill;
+    vector<pair<int32_t, Key>> vacuumLeaves; // Rebuilt leaves in key order, with their largest key
+
+    // Optional filter that answers lookups and deletes of missing keys without descending the tree
+    bool filterEnabled;
+    KeyFilter<Key> keyFilter;
+
+    // "newPageSize" and "newBufferedWrites" are only used if the file is empty, otherwise the header of the file wins
+    Table(char* fn, uint32_t newPageSize = DEFAULT_PAGE_SIZE, bool newBufferedWrites = false) {
         filename = string(fn);
         fd.open(filename, ios::out | ios::in );
 
         pages.resize(MAX_PAGES, nullptr);
+        resident = vector<atomic<uint8_t>>(MAX_PAGES);
 
         fd.seekg(0, ios_base::end);
 
-        int fileSize = fd.tellg();
-        page_count = ceil((double)fileSize / PAGE_SIZE);
+        int64_t fileSize = fd.tellg();
+        readFileHeader(fileSize, newPageSize, newBufferedWrites);
+        page_count = max<int64_t>(0, ceil((double)(fileSize - dataOffset) / pageSize));
 
         cout << "The total pages are : " << page_count << "\n";
         root = findRoot(0); // findRoot() depends on page_count. so it should be called after initializing page_count
+
+        lastLeaf = -1;
+        lastInsertKey = Key();
+        appendRun = 0;
+
+        freePage.resize(MAX_PAGES, 0);
+        freeCount = 0;
+        rebuildFreeList();
+
+        vacuumActive = false;
+        vacuumHasKey = false;
+        vacuumFill = VACUUM_FILL_FACTOR;
+
+        shapeVersion = 0;
+        heightVersion = -1;
+        cachedHeight = 0;
+
+        filterEnabled = false;
         cout << "The root is initialized to : " << root << "\n";
     }
 
 
+    void readFileHeader(int64_t fileSize, uint32_t newPageSize, bool newBufferedWrites) {
+        FileHeader header = FileHeader();
+        if(fileSize > 0) {
+            fd.seekg(0);
+            fd.read((char*)&header, sizeof(header));
+            // A short read leaves the stream failed, and every later seek, read and write would be ignored
+            bool complete = fd.gcount() == sizeof(header);
+            fd.clear();
+            if(!complete) {
+                cout << "Error: " << filename << " is too short to be a database file\n";
+                exit(1);
+            }
+        }
+
+        if(fileSize > 0 && header.magic == FILE_MAGIC) {
+            pageSize = header.pageSize;
+            dataOffset = pageSize;
+            bufferedWrites = header.flags & FILE_FLAG_BUFFERED_WRITES;
+        }
+        else if(fileSize > 0) {
+            pageSize = LEGACY_PAGE_SIZE;
+            dataOffset = 0;
+            bufferedWrites = false;
+        }
+        else {
+            pageSize = newPageSize;
+            dataOffset = pageSize;
+            bufferedWrites = newBufferedWrites;
+        }
+
+        if(!isValidPageSize(pageSize)) {
+            cout << "Error: unsupported page size " << pageSize << "\n";
+            exit(1);
+        }
+        if(bufferedWrites && pageSize < MIN_BUFFERED_PAGE_SIZE) {
+            cout << "Error: buffered writes need a page size of at least " << MIN_BUFFERED_PAGE_SIZE << "\n";
+            exit(1);
+        }
+
+        if(fileSize == 0) {
+            header.magic = FILE_MAGIC;
+            header.pageSize = pageSize;
+            header.flags = bufferedWrites ? FILE_FLAG_BUFFERED_WRITES : 0;
+            fd.seekp(0);
+            fd.write((char*)&header, sizeof(header));
+        }
+
+        maxLeafRows = Layout<Schema>::maxLeafRows(pageSize);
+        minLeafRows = Layout<Schema>::minLeafRows(pageSize);
+        maxInternalRows = Layout<Schema>::maxInternalRows(pageSize, bufferedWrites);
+        maxInternalKeys = Layout<Schema>::maxInternalKeys(pageSize, bufferedWrites);
+        minInternalKeys = Layout<Schema>::minInternalKeys(pageSize, bufferedWrites);
+        messageCapacity = Layout<Schema>::messageCapacity(pageSize);
+    }
+
+    // Hands out "preferred" if it is free or at the end of the file, otherwise the lowest free page.
+    // Returns -1 if the file is full.
+    int allocatePage(int preferred) {
+        int res = -1;
+        if(preferred >= 0 && preferred < (int)MAX_PAGES && (preferred == page_count || (preferred < page_count && freePage[preferred])))
+            res = preferred;
+        if(res == -1 && freeCount > 0) {
+            for(int i=0;i<page_count;++i) {
+                if(freePage[i]) { res = i; break; }
+            }
+        }
+        if(res == -1) {
+            if(page_count >= (int)MAX_PAGES)
+                return -1;
+            res = page_count;
+        }
+
+        if(res == page_count) {
+            ++page_count;
+        }
+        else {
+            freePage[res] = 0;
+            --freeCount;
+        }
+
+        if(pages[res] == nullptr) {
+            pages[res] = new PageNode(res, pageSize);
+            resident[res].store(1, memory_order_release);
+        }
+        else {
+            pages[res]->reset();
+        }
+        return res;
+    }
+    // The free list is not stored in the file. Every page the tree does not reach, e.g. the old tree of a vacuum or
+    // a node retired by a merge, is free. Only the internal nodes have to be read to find the reachable pages.
+    void rebuildFreeList() {
+        vector<uint8_t> live(MAX_PAGES, 0);
+        loadPage(root);
+        live[root] = 1;
+        vector<PageNode*> level = {pages[root]};
+        for(int height = nodeHeight(pages[root]); height > 0; --height) {
+            vector<PageNode*> nextLevel;
+            for(auto pg : level) {
+                int len = pg->size();
+                for(int i=0;i<len;i+=2) {
+                    int child = pg->getInternalPointer(i);
+                    live[child] = 1;
+                    if(height > 1) nextLevel.push_back(childNode(pg, i));
+                }
+            }
+            level = nextLevel;
+        }
+
+        for(int i=0;i<page_count;++i) {
+            if(!live[i] && !freePage[i])
+                releasePage(i);
+        }
+    }
+    void releasePage(int index) {
+        if(pages[index] != nullptr)
+            pages[index]->reset();
+        freePage[index] = 1;
+        ++freeCount;
+    }
+
     int findEmptyPage() {
-        int res = page_count;
-        if(res >= MAX_PAGES) {
+        int res = allocatePage(-1);
+        if(res == -1) {
             cout << "Error : empty page is out of bounds !!\n";
             exit(1);
         }
-        ++page_count;
-        pages[res] = new PageNode();
 
         // cout << "\n------ Page Number " << res << " --------\n";
         // pages[res]->pageDetail();
@@ -252,26 +936,30 @@ public:
         return res;
     }
     void loadPage(int index) {
-
-        fd.seekg(0, ios_base::end);
-        int fileSize = fd.tellg();
-        if(fileSize < 0) {
-            cout << "tellg is -1 !\n";
-            exit(1);
-        }
-
         if(index >= MAX_PAGES) {
             cout << "Error: page index out of bounds";
             exit(1);
         }
-        
+        if(resident[index].load(memory_order_acquire))
+            return;
+
+        lock_guard<mutex> guard(pageLock);
         if(pages[index] == nullptr) {
-            pages[index] = new PageNode();
+            TRACE_SPAN("page load");
+            fd.seekg(0, ios_base::end);
+            int fileSize = fd.tellg();
+            if(fileSize < 0) {
+                cout << "tellg is -1 !\n";
+                exit(1);
+            }
+
+            pages[index] = new PageNode(index, pageSize);
             
             // If the page with the given number exists within the file then just read it from the file.
             if(index < page_count) {
-                fd.seekg(index * PAGE_SIZE);
-                fd.read((char*)(pages[index]->page), PAGE_SIZE);
+                TRACE_SPAN("disk read");
+                fd.seekg(dataOffset + (int64_t)index * pageSize);
+                fd.read((char*)(pages[index]->page), pageSize);
             }
             else {
                 ++page_count;
@@ -279,25 +967,42 @@ public:
                     pages[index]->initializeLeafNode();
                 }
             }
-
+            resident[index].store(1, memory_order_release);
         }
         return ;
     }
 
+    // Returns the frame of the child at "index" of the internal node "pg", loading it and swizzling the cell on first use
+    PageNode* childNode(PageNode* pg, int index) {
+        PageNode* child = pg->getChild(index);
+        if(child != nullptr)
+            return child;
+
+        int childPageNumber = pg->getInternalPointer(index);
+        loadPage(childPageNumber);
+        child = pages[childPageNumber];
+        pg->swizzleChild(index, child);
+        return child;
+    }
+
     // Search
-    int findPage(int curIndex, int64_t x) {
+    // Index of the pointer to the child of the internal node "pg" that covers "x"
+    int childIndex(PageNode* pg, const Key& x) {
+        int ind, len = pg->size();
+        for(ind = 1; ind < len; ind+=2) {
+            if(pg->getInternalKey(ind) >= x) break;
+        }
+        return ind - 1;
+    }
+    int findPage(int curIndex, const Key& x) {
+        TRACE_SPAN("descent");
         loadPage(curIndex); // load page from memory
+        PageNode* pg = pages[curIndex];
 
-        if(pages[curIndex]->isLeaf())
-            return curIndex;
-
-        int ind, len = pages[curIndex]->size();
-        for(ind = 1; ind < len; ind+=2) {
-            int64_t key = pages[curIndex]->getInternalKey(ind);
-            if(key >= x) break;
+        while(!pg->isLeaf()) {
+            pg = childNode(pg, childIndex(pg, x));
         }
-        ind = pages[curIndex]->getInternalPointer(ind - 1);
-        return findPage(ind, x);
+        return pg->pageNumber;
     }
     int findRoot(int curIndex) {
         loadPage(curIndex);
@@ -328,8 +1033,7 @@ public:
         cout << index << "<-->";
         int len = pages[index]->size();
         for(int i = 0; i < len; ++i) {
-            int64_t val = pages[index]->getLeafKey(i);
-            cout << val << ",";
+            cout << pages[index]->getLeafKey(i) << ",";
         }
         cout << " : ";
     }
@@ -359,19 +1063,109 @@ public:
         cout << "\n\n";
     }
     void printAllRows() {
-        int64_t cur = root;
-        while(!pages[cur]->isLeaf()) {
-            cur = pages[cur]->getInternalPointer(0);
+        flushAllMessages();
+        loadPage(root);
+        PageNode* pg = pages[root];
+        while(!pg->isLeaf()) {
+            pg = childNode(pg, 0);
         }
+        int64_t cur = pg->pageNumber;
         while(cur >= 0) {
+            loadPage(cur);
             int len = pages[cur]->size();
             for(int i=0;i<len;++i) {
-                Row row = pages[cur]->getLeafRow(i);
-                cout << "( " << row.id << ", " << row.name << ", " << row.email << " )\n";
+                Schema::print(pages[cur]->getLeafRow(i));
             }
             cur = pages[cur]->getNext();
         }
     }
+
+    // Separator keys that cut the key space into about "parts" ranges. Levels are added from the root down until
+    // there are enough of them, so every range ends exactly at a leaf boundary.
+    vector<Key> scanSplitKeys(int parts) {
+        vector<Key> keys;
+        loadPage(root);
+        vector<PageNode*> level = {pages[root]};
+        // Only internal nodes are loaded here, the leaves are left to the workers
+        for(int height = nodeHeight(pages[root]); height > 0 && (int)keys.size() < parts - 1; --height) {
+            vector<PageNode*> nextLevel;
+            for(auto pg : level) {
+                int len = pg->size();
+                for(int i=0;i<len;++i) {
+                    if(i % 2) keys.push_back(pg->getInternalKey(i));
+                    else if(height > 1) nextLevel.push_back(childNode(pg, i));
+                }
+            }
+            level = nextLevel;
+        }
+        sort(keys.begin(), keys.end());
+
+        vector<Key> res;
+        int total = keys.size(), wanted = min(parts - 1, total);
+        for(int i=1;i<=wanted;++i) {
+            res.push_back(keys[(int64_t)i * total / (wanted + 1)]);
+        }
+        res.erase(unique(res.begin(), res.end()), res.end());
+        return res;
+    }
+
+    // Scans the leaves between "first" and "last" (exclusive), -1 meaning the end of the chain
+    void scanLeaves(int first, int last, const function<bool(const Row&)>& predicate, ScanResult& result, vector<Row>* rows) {
+        for(int cur = first; cur != last && cur >= 0; ) {
+            loadPage(cur);
+            PageNode* pg = pages[cur];
+            int len = pg->size();
+            for(int i=0;i<len;++i) {
+                Row row = pg->getLeafRow(i);
+                if(predicate && !predicate(row)) continue;
+                result.add(row);
+                if(rows != nullptr) rows->push_back(row);
+            }
+            cur = pg->getNext();
+        }
+    }
+
+    // Splits the leaf chain along separator keys of the upper levels and scans every range on its own thread.
+    // Matching rows are appended to "rows" in key order if it is given.
+    ScanResult parallelScan(int threadCount, function<bool(const Row&)> predicate = nullptr, vector<Row>* rows = nullptr) {
+        if(threadCount <= 0)
+            threadCount = max(1u, thread::hardware_concurrency());
+        TRACE_SPAN("parallel scan");
+        flushAllMessages(); // The threads only read the leaves
+
+        // Find the first leaf of every range. The rightmost leaf left of a separator is the one findPage() returns for it.
+        vector<int> starts;
+        loadPage(root);
+        PageNode* pg = pages[root];
+        while(!pg->isLeaf()) {
+            pg = childNode(pg, 0);
+        }
+        starts.push_back(pg->pageNumber);
+        for(const Key& key : scanSplitKeys(threadCount)) {
+            starts.push_back(pages[findPage(root, key)]->getNext());
+        }
+        starts.push_back(-1);
+
+        int parts = starts.size() - 1;
+        vector<ScanResult> results(parts);
+        vector<vector<Row>> partRows(parts);
+        vector<thread> workers;
+        for(int i=0;i<parts;++i) {
+            workers.emplace_back([&, i]() {
+                TRACE_SPAN("scan range");
+                scanLeaves(starts[i], starts[i+1], predicate, results[i], rows != nullptr ? &partRows[i] : nullptr);
+            });
+        }
+
+        ScanResult total;
+        for(int i=0;i<parts;++i) {
+            workers[i].join();
+            total.merge(results[i]);
+            if(rows != nullptr) rows->insert(rows->end(), partRows[i].begin(), partRows[i].end());
+        }
+        return total;
+    }
+
     // Insert
     int64_t splitInternalNode(int pageNumber, int index) {
         PageNode* pg = pages[pageNumber];
@@ -381,7 +1175,7 @@ public:
 
         int rightSize = 0;
         for(int i=index+1; i<sz; ++i) {
-            pages[right]->setInternalKey(rightSize, pg->getInternalKey(i));
+            memcpy(pages[right]->getInternalRowByteOffset(rightSize), pg->getInternalRowByteOffset(i), INTERNAL_CELL_SIZE);
             ++rightSize;
         }
         pages[right]->setNumRows(rightSize);
@@ -389,13 +1183,16 @@ public:
 
 
         for(int i=0; i<rightSize; i+=2) {
-            uint64_t ptr = pages[right]->getInternalPointer(i);
-            pages[ptr]->setParent(right);
+            childNode(pages[right], i)->setParent(right);
         }
 
+        Key midKey = pg->getInternalKey(index);
+        moveMessages(pg, pages[right], [&](const Key& key) { return key > midKey; });
+
         return right;
     }
-    void insertIntoInternal(int pageNumber, int64_t key, int left, int right) {
+    void insertIntoInternal(int pageNumber, const Key& key, int left, int right) {
+        ++shapeVersion;
         PageNode* pg = nullptr;
         if(pageNumber == -1) {
             pageNumber = findEmptyPage();
@@ -427,12 +1224,16 @@ public:
         pg->setNumRows(pg->size() + 2);
 
         sz = pg->size();
-        if(sz > MAX_INTERNAL_ROWS) {
+        if(sz > maxInternalRows) {
+            TRACE_SPAN("split internal");
             int mid = sz / 2;
+            // The new child went to the end while appending, so the left part will not grow again
+            if(appendRun >= APPEND_RUN_THRESHOLD && i+1 == sz-1)
+                mid = sz * APPEND_INTERNAL_SPLIT_RATIO;
             if(mid % 2 == 0) --mid;
 
             right = splitInternalNode(pageNumber, mid);
-            int64_t midKey = pg->getInternalKey(mid);
+            Key midKey = pg->getInternalKey(mid);
             insertIntoInternal(pg->parent(), midKey, pageNumber, right);
         }
     }
@@ -450,12 +1251,14 @@ public:
         pages.push_back(pgnd);
         return rightHalfIndex;
     }
-    void insertIntoLeaf(int pageNumber, Row& row) {
+    // Returns the page number of the leaf that holds the row after the insert
+    int insertIntoLeaf(int pageNumber, Row& row) {
         int len = pages[pageNumber]->size();
         PageNode* pg = pages[pageNumber];
+        Key key = Schema::key(row);
         int pos;
         for(pos = len-1; pos >= 0; --pos) {
-            if(pg->getLeafKey(pos) > row.id)
+            if(pg->getLeafKey(pos) > key)
                 pg->copyLeafRow(pos, pos+1);
             else
                 break;
@@ -465,24 +1268,65 @@ public:
         
         int sz = pg->size();
 
-        if(sz > MAX_LEAF_ROWS) {
+        if(sz > maxLeafRows) {
+            TRACE_SPAN("split leaf");
             int mid = (sz - 1) / 2;
-            int64_t midKey = pg->getLeafKey(mid);
+            // Appending to the rightmost leaf: keep the left half full and start the right one with the new row
+            if(appendRun >= APPEND_RUN_THRESHOLD && pg->getNext() == -1 && pos+1 == sz-1)
+                mid = sz - 2;
+            Key midKey = pg->getLeafKey(mid);
             int rightHalfPageNumber = splitLeafNode(pageNumber, mid+1);
             pages[rightHalfPageNumber]->setNext(pg->getNext());
             pg->setNext(rightHalfPageNumber);
             insertIntoInternal(pg->parent(), midKey, pageNumber, rightHalfPageNumber);
+            if(key > midKey)
+                return rightHalfPageNumber;
         }
+        return pageNumber;
+    }
+
+    // Checks whether "key" certainly belongs to the given leaf, i.e. findPage() would return it as well
+    bool leafCovers(int pageNumber, const Key& key) {
+        PageNode* pg = pages[pageNumber];
+        int len = pg->size();
+        if(len == 0 || key <= pg->getLeafKey(0))
+            return false;
+        return pg->getNext() == -1 || key <= pg->getLeafKey(len-1);
     }
 
     void insert(Row &row) {
-        int pageNumber = findPage(root, row.id);
-        insertIntoLeaf(pageNumber, row);
+        TRACE_SPAN("insert");
+        Key key = Schema::key(row);
+        vacuumMirrorInsert(row);
+
+        if(key > lastInsertKey) ++appendRun;
+        else appendRun = 0;
+        lastInsertKey = key;
+
+        if(bufferWrites()) {
+            lastLeaf = -1;
+            bufferMessage(MESSAGE_INSERT, row);
+        }
+        else {
+            // Skip the descent when the key lands in the leaf of the previous insert
+            int pageNumber;
+            if(lastLeaf != -1 && leafCovers(lastLeaf, key))
+                pageNumber = lastLeaf;
+            else
+                pageNumber = findPage(root, key);
+            lastLeaf = insertIntoLeaf(pageNumber, row);
+        }
+
+        if(filterEnabled) {
+            keyFilter.add(key);
+            if(keyFilter.keyCount > keyFilter.capacity)
+                rebuildKeyFilter(2 * keyFilter.keyCount);
+        }
     }
 
     // Delete
 
-    void mergeInternalNodes(int leftPageNumber, int rightPageNumber, int mid) {
+    void mergeInternalNodes(int leftPageNumber, int rightPageNumber, const Key& mid) {
         PageNode* LPG = pages[leftPageNumber];
         PageNode* RPG = pages[rightPageNumber];
 
@@ -490,19 +1334,20 @@ public:
         LPG->setInternalKey(Llen, mid);
         ++Llen;
         for(int i=0;i<Rlen;++i) {
-            LPG->setInternalKey(Llen, RPG->getInternalKey(i));
+            memcpy(LPG->getInternalRowByteOffset(Llen), RPG->getInternalRowByteOffset(i), INTERNAL_CELL_SIZE);
             ++Llen;
             if(i % 2 == 0) {
-                pages[RPG->getInternalPointer(i)]->setParent(leftPageNumber);
+                childNode(RPG, i)->setParent(leftPageNumber);
             }
         }
         LPG->setNumRows(Llen);
+        moveMessages(RPG, LPG, [](const Key&) { return true; });
 
         // WARNING !! De-allocate the right node here.
     }
 
     // REVIEW REQUIRED !! (De allocation)
-    void deleteInternal(int pageNumber, int key, int index) {
+    void deleteInternal(int pageNumber, const Key& key, int index) {
         PageNode* pgnd = pages[pageNumber];
         int len = pgnd->size();
 
@@ -513,13 +1358,10 @@ public:
         pgnd->setNumRows(len);
 
         if(len == 1 && pgnd->parent() == -1) {
-            int loneChildPageNumber = pgnd->getInternalPointer(0);
-            // De-allocate page with "pageNumber" here !
-            root = loneChildPageNumber;
-            pages[root]->setParent(-1);
+            collapseRoot();
             return;
         }
-        if(pages[pageNumber]->parent() == -1 || len / 2 >= MIN_INTERNAL_KEYS) {
+        if(pages[pageNumber]->parent() == -1 || len / 2 >= minInternalKeys) {
             return;
         }
 
@@ -533,33 +1375,52 @@ public:
         }
         --ind;
 
-        if(ind-2 >= 0) {leftSiblingPageNumber = pages[parentPageNumber]->getInternalPointer(ind-2); Llen = pages[leftSiblingPageNumber]->size();}
-        if(ind+2 < parentLen) {rightSiblingPageNumber = pages[parentPageNumber]->getInternalPointer(ind+2);  pages[rightSiblingPageNumber]->size();}
+        if(ind-2 >= 0) {leftSiblingPageNumber = childNode(pages[parentPageNumber], ind-2)->pageNumber; Llen = pages[leftSiblingPageNumber]->size();}
+        if(ind+2 < parentLen) {rightSiblingPageNumber = childNode(pages[parentPageNumber], ind+2)->pageNumber;  pages[rightSiblingPageNumber]->size();}
 
-        if(leftSiblingPageNumber != -1 && pages[leftSiblingPageNumber]->keySize() > MIN_INTERNAL_KEYS) {
-            pages[pageNumber]->insertInternalCell(0, pages[parentPageNumber]->getInternalKey(ind-1));
-            pages[pageNumber]->insertInternalCell(0, pages[leftSiblingPageNumber]->getInternalPointer(Llen-1));
-            pages[pages[leftSiblingPageNumber]->getInternalPointer(Llen-1)]->setParent(pageNumber);
+        // In write-optimized mode the messages for the keys of a child move along with it. The node stays short of
+        // keys if they do not fit into the receiving buffer.
+        bool borrowLeft = false, borrowRight = false;
+        Key leftSeparator = Key(), rightSeparator = Key();
+        if(leftSiblingPageNumber != -1 && pages[leftSiblingPageNumber]->keySize() > minInternalKeys) {
+            leftSeparator = pages[leftSiblingPageNumber]->getInternalKey(Llen-2);
+            borrowLeft = messagesFit(pickedMessageBytes(pages[leftSiblingPageNumber], [&](const Key& k) { return k > leftSeparator; }), pgnd);
+        }
+        if(rightSiblingPageNumber != -1 && pages[rightSiblingPageNumber]->keySize() > minInternalKeys) {
+            rightSeparator = pages[rightSiblingPageNumber]->getInternalKey(1);
+            borrowRight = messagesFit(pickedMessageBytes(pages[rightSiblingPageNumber], [&](const Key& k) { return k <= rightSeparator; }), pgnd);
+        }
+
+        if(borrowLeft) {
+            TRACE_SPAN("borrow internal");
+            pages[pageNumber]->insertInternalKey(0, pages[parentPageNumber]->getInternalKey(ind-1));
+            childNode(pages[leftSiblingPageNumber], Llen-1)->setParent(pageNumber);
+            pages[pageNumber]->insertInternalPointer(0, pages[leftSiblingPageNumber]->getInternalPointer(Llen-1));
             --Llen;
             pages[leftSiblingPageNumber]->setNumRows(Llen);
             pages[parentPageNumber]->setInternalKey(ind-1, pages[leftSiblingPageNumber]->getInternalKey(Llen-1));
             --Llen;
             pages[leftSiblingPageNumber]->setNumRows(Llen);
+            moveMessages(pages[leftSiblingPageNumber], pgnd, [&](const Key& k) { return k > leftSeparator; });
         }
-        else if(rightSiblingPageNumber != -1 && pages[rightSiblingPageNumber]->keySize() > MIN_INTERNAL_KEYS) {
-            pages[pageNumber]->insertInternalCell(len, pages[parentPageNumber]->getInternalKey(ind+1));
+        else if(borrowRight) {
+            TRACE_SPAN("borrow internal");
+            pages[pageNumber]->insertInternalKey(len, pages[parentPageNumber]->getInternalKey(ind+1));
             ++len;
-            pages[pageNumber]->insertInternalCell(len, pages[rightSiblingPageNumber]->getInternalPointer(0));
-            pages[pages[rightSiblingPageNumber]->getInternalPointer(0)]->setParent(pageNumber);
+            childNode(pages[rightSiblingPageNumber], 0)->setParent(pageNumber);
+            pages[pageNumber]->insertInternalPointer(len, pages[rightSiblingPageNumber]->getInternalPointer(0));
             pages[rightSiblingPageNumber]->eraseInternalCell(0);
             pages[parentPageNumber]->setInternalKey(ind+1, pages[rightSiblingPageNumber]->getInternalKey(0)); // Keys have shifted to even positions due to the deletion in the previous line
             pages[rightSiblingPageNumber]->eraseInternalCell(0);
+            moveMessages(pages[rightSiblingPageNumber], pgnd, [&](const Key& k) { return k <= rightSeparator; });
         }
-        else if(leftSiblingPageNumber != -1) {
+        else if(leftSiblingPageNumber != -1 && messagesFit(messageBytes(pgnd), pages[leftSiblingPageNumber])) {
+            TRACE_SPAN("merge internal");
             mergeInternalNodes(leftSiblingPageNumber, pageNumber, pages[parentPageNumber]->getInternalKey(ind-1));
             deleteInternal(parentPageNumber, pages[parentPageNumber]->getInternalKey(ind-1), ind-1);
         }
-        else if(rightSiblingPageNumber != -1) {
+        else if(rightSiblingPageNumber != -1 && messagesFit(messageBytes(pages[rightSiblingPageNumber]), pgnd)) {
+            TRACE_SPAN("merge internal");
             mergeInternalNodes(pageNumber, rightSiblingPageNumber, pages[parentPageNumber]->getInternalKey(ind+1));
             deleteInternal(parentPageNumber, pages[parentPageNumber]->getInternalKey(ind+1), ind+1);
         }
@@ -581,7 +1442,7 @@ public:
         // WARNING !! delete the right page here
     }
 
-    void deleteLeaf(int pageNumber, int key) {
+    void deleteLeaf(int pageNumber, const Key& key) {
         PageNode* pgnd = pages[pageNumber];
         int len = pgnd->size();
         int data_index;
@@ -594,6 +1455,8 @@ public:
             cout << "Error: Key does not exist\n";
             return;
         }
+        if(filterEnabled)
+            keyFilter.remove(key);
 
         for(int ind = data_index+1; ind < len; ++ind) {
             pgnd->copyLeafRow(ind, ind-1);
@@ -603,9 +1466,10 @@ public:
         pgnd->setNumRows(len);
 
 
-        if(pgnd->parent() == -1 || len >= MIN_LEAF_ROWS) {
+        if(pgnd->parent() == -1 || len >= minLeafRows) {
             return;
         }
+        ++shapeVersion;
 
         int leftSiblingPageNumber = -1, rightSiblingPageNumber = -1, parentPageNumber = pgnd->parent();
 
@@ -619,10 +1483,11 @@ public:
                 break;
         }
         --ind;
-        if(ind-2 >= 0) leftSiblingPageNumber = pages[parentPageNumber]->getInternalPointer(ind - 2);
-        if(ind+2 < parentDataSize) rightSiblingPageNumber = pages[parentPageNumber]->getInternalPointer(ind + 2);
+        if(ind-2 >= 0) leftSiblingPageNumber = childNode(pages[parentPageNumber], ind - 2)->pageNumber;
+        if(ind+2 < parentDataSize) rightSiblingPageNumber = childNode(pages[parentPageNumber], ind + 2)->pageNumber;
 
-        if(leftSiblingPageNumber != -1 && pages[leftSiblingPageNumber]->size() > MIN_LEAF_ROWS) {
+        if(leftSiblingPageNumber != -1 && pages[leftSiblingPageNumber]->size() > minLeafRows) {
+            TRACE_SPAN("borrow leaf");
             int leftS_len = pages[leftSiblingPageNumber]->size();
             Row row = pages[leftSiblingPageNumber]->getLeafRow(leftS_len - 1);
 
@@ -639,15 +1504,16 @@ public:
             pgnd->setNumRows(len);
 
             // Update the parent
-            pages[parentPageNumber]->setInternalPointer(ind - 1, pages[leftSiblingPageNumber]->getLeafKey(leftS_len-1));
+            pages[parentPageNumber]->setInternalKey(ind - 1, pages[leftSiblingPageNumber]->getLeafKey(leftS_len-1));
 
         }
-        else if(rightSiblingPageNumber != -1 && pages[rightSiblingPageNumber]->size() > MIN_LEAF_ROWS) {
+        else if(rightSiblingPageNumber != -1 && pages[rightSiblingPageNumber]->size() > minLeafRows) {
+            TRACE_SPAN("borrow leaf");
             int rightS_len = pages[rightSiblingPageNumber]->size();
             Row row = pages[rightSiblingPageNumber]->getLeafRow(0);
 
             // Update the parent
-            pages[parentPageNumber]->setInternalPointer(ind + 1, pages[rightSiblingPageNumber]->getLeafKey(0));
+            pages[parentPageNumber]->setInternalKey(ind + 1, pages[rightSiblingPageNumber]->getLeafKey(0));
 
             // Update the current node with the borrowed value
             pgnd->setLeafRow(row, len);
@@ -663,10 +1529,12 @@ public:
 
         }
         else if(leftSiblingPageNumber != -1) {
+            TRACE_SPAN("merge leaf");
             mergeLeafNodes(leftSiblingPageNumber, pageNumber);
             deleteInternal(parentPageNumber, pages[parentPageNumber]->getInternalKey(ind-1), ind-1);
         }
         else if(rightSiblingPageNumber != -1) {
+            TRACE_SPAN("merge leaf");
             mergeLeafNodes(pageNumber, rightSiblingPageNumber);
             deleteInternal(parentPageNumber, pages[parentPageNumber]->getInternalKey(ind+1), ind+1);
         }
@@ -674,18 +1542,660 @@ public:
 
     }
 
-    void deleteData(int x) {
+    void deleteData(const Key& x) {
+        TRACE_SPAN("delete");
+        if(filterEnabled && !keyFilter.mayContain(x)) {
+            cout << "Error: Key does not exist\n";
+            return;
+        }
+        vacuumMirrorDelete(x);
+        lastLeaf = -1; // Merges may retire the cached leaf
+        if(bufferWrites()) {
+            bufferMessage(MESSAGE_DELETE, keyRow(x));
+            return;
+        }
         int pageNumber = findPage(root, x);
         deleteLeaf(pageNumber, x);
     }
 
+    // Point lookup, returns false if the key does not exist
+    bool search(const Key& key, Row& row) {
+        TRACE_SPAN("search");
+        if(filterEnabled && !keyFilter.mayContain(key))
+            return false;
+
+        loadPage(root);
+        PageNode* pg = pages[root];
+        while(!pg->isLeaf()) {
+            // Messages higher up are newer than the ones below them, so the first node with one decides
+            int count = messageCount(pg), found = -1;
+            uint32_t offset = 0;
+            for(int i=0;i<count;++i) {
+                if(pg->getMessageKey(offset) == key) found = offset;
+                offset += PageNode::messageSize(pg->getMessageOp(offset));
+            }
+            if(found != -1) {
+                if(pg->getMessageOp(found) == MESSAGE_DELETE)
+                    return false;
+                row = pg->getMessageRow(found);
+                return true;
+            }
+            pg = childNode(pg, childIndex(pg, key));
+        }
+        int len = pg->size();
+        for(int i=0;i<len;++i) {
+            if(pg->getLeafKey(i) == key) {
+                row = pg->getLeafRow(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Write-optimized mode
+    // Inserts and deletes are queued as messages in the root. When the buffer of an internal node is full, the
+    // messages bound for its busiest child are moved one level down together, so a leaf is visited once for a
+    // whole batch of rows instead of once per row. Lookups pick up pending messages on their way down.
+
+    bool bufferWrites() {
+        loadPage(root);
+        return bufferedWrites && !vacuumActive && !pages[root]->isLeaf();
+    }
+    int messageCount(PageNode* pg) {
+        if(!bufferedWrites || pg->isLeaf()) return 0;
+        return pg->messageCount();
+    }
+    uint32_t messageBytes(PageNode* pg) {
+        if(!bufferedWrites || pg->isLeaf()) return 0;
+        return pg->messageBytes();
+    }
+    bool messagesFit(uint32_t bytes, PageNode* pg) {
+        return messageBytes(pg) + bytes <= messageCapacity;
+    }
+    uint32_t pickedMessageBytes(PageNode* pg, const function<bool(const Key&)>& pick) {
+        int count = messageCount(pg);
+        uint32_t bytes = 0, offset = 0;
+        for(int i=0;i<count;++i) {
+            uint32_t size = PageNode::messageSize(pg->getMessageOp(offset));
+            if(pick(pg->getMessageKey(offset))) bytes += size;
+            offset += size;
+        }
+        return bytes;
+    }
+    // Appends the messages of "from" with a picked key to the buffer of "to", keeping their order
+    void moveMessages(PageNode* from, PageNode* to, const function<bool(const Key&)>& pick) {
+        int count = messageCount(from), kept = 0;
+        uint32_t offset = 0, keptBytes = 0;
+        for(int i=0;i<count;++i) {
+            uint32_t size = PageNode::messageSize(from->getMessageOp(offset));
+            if(pick(from->getMessageKey(offset))) {
+                to->appendMessage(from->getMessageOp(offset), from->getMessageRow(offset));
+            }
+            else {
+                if(keptBytes != offset) from->moveMessage(offset, keptBytes);
+                keptBytes += size;
+                ++kept;
+            }
+            offset += size;
+        }
+        if(count > 0) {
+            from->setMessageCount(kept);
+            from->setMessageBytes(keptBytes);
+        }
+    }
+    // Height above the leaves
+    int nodeHeight(PageNode* pg) {
+        int height = 0;
+        while(!pg->isLeaf()) {
+            pg = childNode(pg, 0);
+            ++height;
+        }
+        return height;
+    }
+    Row keyRow(const Key& key) {
+        Row row = Row();
+        memcpy(MV_VOID(&row, Layout<Schema>::KEY_OFFSET), &key, Layout<Schema>::KEY_SIZE);
+        return row;
+    }
+
+    // Only a change of shape can move the root, so the height is kept until then
+    int rootHeight() {
+        if(heightVersion != shapeVersion) {
+            loadPage(root);
+            cachedHeight = nodeHeight(pages[root]);
+            heightVersion = shapeVersion;
+        }
+        return cachedHeight;
+    }
+    void bufferMessage(uint8_t op, const Row& row) {
+        loadPage(root);
+        deliverMessage(op, row, pages[root], rootHeight());
+    }
+    // Node at "height" above the leaves on the path of "key". "bounded" tells whether the node has a right
+    // neighbour, and if so "upper" is the largest key it covers.
+    PageNode* pathNode(const Key& key, int height, bool& bounded, Key& upper) {
+        loadPage(root);
+        PageNode* pg = pages[root];
+        bounded = false;
+        for(int h = rootHeight(); h > height; --h) {
+            int index = childIndex(pg, key);
+            if(index + 1 < (int)pg->size()) {
+                bounded = true;
+                upper = pg->getInternalKey(index + 1);
+            }
+            pg = childNode(pg, index);
+        }
+        return pg;
+    }
+    // Puts the message into the buffer of "pg", the node at "height" on the path of its key, flushing that buffer
+    // first if it is full. At the leaves the message is applied. The node is looked up again only if the flush
+    // changed the shape of the tree.
+    void deliverMessage(uint8_t op, const Row& row, PageNode* pg, int height) {
+        while(true) {
+            if(pg->isLeaf()) {
+                applyMessage(pg->pageNumber, op, row);
+                return;
+            }
+            if(messagesFit(PageNode::messageSize(op), pg)) {
+                pg->appendMessage(op, row);
+                return;
+            }
+            uint64_t version = shapeVersion;
+            flushNode(pg->pageNumber, height);
+            if(shapeVersion != version) {
+                bool bounded;
+                Key upper;
+                height = min(height, rootHeight()); // Merges may have collapsed the root below "height"
+                pg = pathNode(Schema::key(row), height, bounded, upper);
+            }
+        }
+    }
+    void applyMessage(int pageNumber, uint8_t op, Row row) {
+        if(op == MESSAGE_INSERT) {
+            insertIntoLeaf(pageNumber, row);
+            return;
+        }
+        lastLeaf = -1; // Merges may retire the cached leaf
+        Key key = Schema::key(row);
+        PageNode* pg = pages[pageNumber];
+        int len = pg->size();
+        for(int i=0;i<len;++i) {
+            if(pg->getLeafKey(i) == key) {
+                deleteLeaf(pageNumber, key);
+                return;
+            }
+        }
+        // Buffered deletes are not checked up front, so one for a missing key is dropped here
+    }
+    // Moves the messages bound for the child with the most of them one level down. "height" is the height of the node.
+    void flushNode(int pageNumber, int height) {
+        TRACE_SPAN("flush");
+        PageNode* pg = pages[pageNumber];
+        int len = pg->size(), count = pg->messageCount();
+        vector<int> child(count), perChild(len, 0);
+        int best = 0;
+        uint32_t offset = 0;
+        for(int i=0;i<count;++i) {
+            child[i] = childIndex(pg, pg->getMessageKey(offset));
+            if(++perChild[child[i]] > perChild[best]) best = child[i];
+            offset += PageNode::messageSize(pg->getMessageOp(offset));
+        }
+
+        vector<pair<uint8_t, Row>> batch;
+        int kept = 0;
+        uint32_t keptBytes = 0;
+        offset = 0;
+        for(int i=0;i<count;++i) {
+            uint32_t size = PageNode::messageSize(pg->getMessageOp(offset));
+            if(child[i] == best) {
+                batch.push_back({pg->getMessageOp(offset), pg->getMessageRow(offset)});
+            }
+            else {
+                if(keptBytes != offset) pg->moveMessage(offset, keptBytes);
+                keptBytes += size;
+                ++kept;
+            }
+            offset += size;
+        }
+        pg->setMessageCount(kept);
+        pg->setMessageBytes(keptBytes);
+
+        // The batch goes straight to the child, in key order. Messages for the same key keep their order. Once a
+        // split or merge below has changed the shape of the tree, the node for the next key is looked up from the
+        // root again, and serves the following keys up to its upper bound.
+        vector<Key> keys(batch.size());
+        vector<int> order(batch.size());
+        for(int i=0;i<(int)batch.size();++i) {
+            keys[i] = Schema::key(batch[i].second);
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] < keys[b]; });
+
+        PageNode* target = childNode(pg, best);
+        int targetHeight = height - 1;
+        uint64_t version = shapeVersion;
+        bool bounded = false;
+        Key upper = Key();
+        for(int i : order) {
+            if(shapeVersion != version || (bounded && keys[i] > upper)) {
+                targetHeight = min(targetHeight, rootHeight());
+                target = pathNode(keys[i], targetHeight, bounded, upper);
+                version = shapeVersion;
+            }
+            deliverMessage(batch[i].first, batch[i].second, target, targetHeight);
+        }
+        loadPage(root);
+        if(!pages[root]->isLeaf() && pages[root]->size() == 1)
+            collapseRoot();
+    }
+    // Drains every buffer, for the readers that walk the leaf chain
+    void flushAllMessages() {
+        if(!bufferedWrites) return;
+        bool flushed = true;
+        while(flushed) {
+            flushed = false;
+            uint64_t version = shapeVersion;
+            loadPage(root);
+            vector<PageNode*> level = {pages[root]};
+            // A flush that changes the shape of the tree may leave "level" and "height" stale, so the walk starts over
+            for(int height = nodeHeight(pages[root]); height > 0 && shapeVersion == version; --height) {
+                vector<PageNode*> nextLevel;
+                for(auto pg : level) {
+                    while(pg->messageCount() > 0 && shapeVersion == version) {
+                        flushNode(pg->pageNumber, height);
+                        flushed = true;
+                    }
+                    if(shapeVersion != version) break;
+                    int len = pg->size();
+                    for(int i=0;i<len;i+=2) {
+                        nextLevel.push_back(childNode(pg, i));
+                    }
+                }
+                level = nextLevel;
+            }
+        }
+    }
+    // A root left with a single child hands over to it, unless it still buffers messages for the keys below
+    void collapseRoot() {
+        PageNode* pg = pages[root];
+        if(messageCount(pg) > 0) return;
+        ++shapeVersion;
+        // De-allocate the old root here !
+        PageNode* child = childNode(pg, 0);
+        if(root != 0) {
+            root = child->pageNumber;
+            child->setParent(-1);
+            return;
+        }
+
+        // The root is looked up from page 0 when the file is opened. A vacuumed tree keeps its root there, so the child
+        // is moved into page 0 instead, as in vacuumFinish(). Otherwise a later split would leave page 0 a stale root.
+        memcpy(pg->page, child->page, pageSize);
+        pg->setParent(-1);
+        if(!pg->isLeaf()) {
+            int len = pg->size();
+            for(int i=0;i<len;i+=2) {
+                childNode(pg, i)->setParent(0);
+            }
+        }
+        releasePage(child->pageNumber);
+        lastLeaf = -1;
+    }
+
+    // Key filter
+
+    // Builds the key filter from the leaves. It lives in memory only, so it has to be enabled again after opening the file.
+    void enableKeyFilter(uint64_t expectedKeys = 0) {
+        filterEnabled = true;
+        rebuildKeyFilter(expectedKeys);
+    }
+    void rebuildKeyFilter(uint64_t expectedKeys) {
+        flushAllMessages();
+        vector<Key> keys;
+        loadPage(root);
+        PageNode* pg = pages[root];
+        while(!pg->isLeaf()) {
+            pg = childNode(pg, 0);
+        }
+        for(int cur = pg->pageNumber; cur >= 0; cur = pages[cur]->getNext()) {
+            loadPage(cur);
+            int len = pages[cur]->size();
+            for(int i=0;i<len;++i) {
+                keys.push_back(pages[cur]->getLeafKey(i));
+            }
+        }
+
+        keyFilter.reset(max<uint64_t>(expectedKeys, 2 * keys.size()));
+        for(const Key& key : keys) {
+            keyFilter.add(key);
+        }
+    }
+
+    // Reorganize
+
+    // Starts rewriting the tree in key order into contiguous pages filled to "fillFactor".
+    // The work is done by vacuumStep(), which the caller interleaves with the regular traffic.
+    void startVacuum(double fillFactor = VACUUM_FILL_FACTOR) {
+        if(vacuumActive) return;
+        flushAllMessages(); // Writes go straight to the leaves until the new tree is in place
+        vacuumActive = true;
+        vacuumHasKey = false;
+        vacuumFill = fillFactor;
+        vacuumLeaves.clear();
+    }
+
+    // Copies the rows of up to "budget" leaves into the rebuilt leaves. Once the last leaf is copied the internal
+    // levels are built on top and the new tree replaces the old one. Returns true when no reorganization is running.
+    bool vacuumStep(uint32_t budget = VACUUM_STEP_LEAVES) {
+        if(!vacuumActive) return true;
+        TRACE_SPAN("vacuum step");
+
+        // Find the first row that has not been copied yet
+        int cur;
+        if(vacuumHasKey) {
+            cur = findPage(root, vacuumLastKey);
+        }
+        else {
+            loadPage(root);
+            PageNode* pg = pages[root];
+            while(!pg->isLeaf()) {
+                pg = childNode(pg, 0);
+            }
+            cur = pg->pageNumber;
+        }
+
+        bool seeking = vacuumHasKey;
+        Key resumeAfter = vacuumLastKey;
+        uint32_t copied = 0;
+        while(cur != -1) {
+            loadPage(cur);
+            PageNode* pg = pages[cur];
+            int len = pg->size();
+            for(int i=0;i<len;++i) {
+                Key key = pg->getLeafKey(i);
+                if(seeking && key <= resumeAfter) continue;
+                seeking = false;
+
+                // Only stop between distinct keys, so that the cursor never splits a run of duplicates
+                if(copied >= budget && vacuumHasKey && key != vacuumLastKey) return false;
+                Row row = pg->getLeafRow(i);
+                if(!vacuumAppendRow(row)) return true;
+            }
+            ++copied;
+            cur = pg->getNext();
+        }
+
+        vacuumFinish();
+        return true;
+    }
+
+    void vacuum(double fillFactor = VACUUM_FILL_FACTOR) {
+        startVacuum(fillFactor);
+        while(!vacuumStep());
+    }
+
+    int vacuumLeafTarget() {
+        int target = round(maxLeafRows * vacuumFill);
+        return min<int>(max<int>(target, minLeafRows), maxLeafRows);
+    }
+    int vacuumInternalTarget() {
+        int target = round((maxInternalKeys + 1) * vacuumFill);
+        return min<int>(max<int>(target, minInternalKeys + 1), maxInternalKeys + 1);
+    }
+
+    void vacuumAbort() {
+        cout << "Error: not enough free pages to reorganize the table\n";
+        for(auto &leaf : vacuumLeaves) {
+            releasePage(leaf.first);
+        }
+        vacuumLeaves.clear();
+        vacuumActive = false;
+    }
+
+    void vacuumRestart() {
+        for(auto &leaf : vacuumLeaves) {
+            releasePage(leaf.first);
+        }
+        vacuumLeaves.clear();
+        vacuumHasKey = false;
+    }
+
+    // Index in vacuumLeaves of the rebuilt leaf that covers "key", which must not be past the copy cursor
+    int vacuumLeafFor(const Key& key) {
+        int lo = 0, hi = vacuumLeaves.size() - 1;
+        while(lo < hi) {
+            int mid = (lo + hi) / 2;
+            if(vacuumLeaves[mid].second >= key) hi = mid;
+            else lo = mid + 1;
+        }
+        return lo;
+    }
+
+    // Writes behind the copy cursor are applied to the rebuilt leaves as well, rows ahead of it are picked up by
+    // later steps. The rebuilt leaves have no parents yet, so a full one is simply split in the list.
+    void vacuumMirrorInsert(Row& row) {
+        Key key = Schema::key(row);
+        if(!vacuumActive || !vacuumHasKey || key > vacuumLastKey) return;
+
+        int index = vacuumLeafFor(key);
+        PageNode* pg = pages[vacuumLeaves[index].first];
+        int pos, len = pg->size();
+        if(len >= (int)maxLeafRows) {
+            int right = allocatePage(vacuumLeaves[index].first + 1);
+            if(right == -1) {
+                vacuumRestart();
+                return;
+            }
+            int mid = len / 2;
+            PageNode* RPG = pages[right];
+            RPG->initializeLeafNode();
+            memcpy(RPG->getLeafRowByteOffset(0), pg->getLeafRowByteOffset(mid), (len - mid) * ROW_SIZE);
+            RPG->setNumRows(len - mid);
+            RPG->setNext(pg->getNext());
+            pg->setNumRows(mid);
+            pg->setNext(right);
+            vacuumLeaves.insert(vacuumLeaves.begin() + index + 1, {right, vacuumLeaves[index].second});
+            vacuumLeaves[index].second = pg->getLeafKey(mid - 1);
+            if(key > vacuumLeaves[index].second) {
+                ++index;
+                pg = RPG;
+            }
+            len = pg->size();
+        }
+        for(pos = len-1; pos >= 0 && pg->getLeafKey(pos) > key; --pos) {
+            pg->copyLeafRow(pos, pos+1);
+        }
+        pg->setLeafRow(row, pos+1);
+        pg->setNumRows(len + 1);
+    }
+    void vacuumMirrorDelete(const Key& key) {
+        if(!vacuumActive || !vacuumHasKey || key > vacuumLastKey) return;
+
+        int index = vacuumLeafFor(key);
+        PageNode* pg = pages[vacuumLeaves[index].first];
+        int pos, len = pg->size();
+        for(pos = 0; pos < len && pg->getLeafKey(pos) != key; ++pos);
+        if(pos == len) return;
+
+        for(int i=pos+1;i<len;++i) {
+            pg->copyLeafRow(i, i-1);
+        }
+        --len;
+        pg->setNumRows(len);
+
+        if(len > 0) {
+            vacuumLeaves[index].second = pg->getLeafKey(len-1);
+            return;
+        }
+        // Drop the emptied leaf from the rebuilt chain
+        if(index > 0)
+            pages[vacuumLeaves[index-1].first]->setNext(pg->getNext());
+        releasePage(vacuumLeaves[index].first);
+        vacuumLeaves.erase(vacuumLeaves.begin() + index);
+        if(vacuumLeaves.empty())
+            vacuumHasKey = false;
+    }
+
+    bool vacuumAppendRow(Row& row) {
+        Key key = Schema::key(row);
+        if(vacuumLeaves.empty() || (int)pages[vacuumLeaves.back().first]->size() >= vacuumLeafTarget()) {
+            int preferred = vacuumLeaves.empty() ? -1 : vacuumLeaves.back().first + 1;
+            int pageNumber = allocatePage(preferred);
+            if(pageNumber == -1) {
+                vacuumAbort();
+                return false;
+            }
+            pages[pageNumber]->initializeLeafNode();
+            if(!vacuumLeaves.empty())
+                pages[vacuumLeaves.back().first]->setNext(pageNumber);
+            vacuumLeaves.push_back({pageNumber, key});
+        }
+
+        PageNode* pg = pages[vacuumLeaves.back().first];
+        int len = pg->size();
+        pg->setLeafRow(row, len);
+        pg->setNumRows(len + 1);
+        vacuumLeaves.back().second = key;
+        vacuumLastKey = key;
+        vacuumHasKey = true;
+        return true;
+    }
+
+    void vacuumFinish() {
+        TRACE_SPAN("vacuum finish");
+        // Even out the last leaf with its neighbour if it ended up under the minimum
+        int leafCount = vacuumLeaves.size();
+        if(leafCount >= 2 && (int)pages[vacuumLeaves[leafCount-1].first]->size() < minLeafRows) {
+            PageNode* LPG = pages[vacuumLeaves[leafCount-2].first];
+            PageNode* RPG = pages[vacuumLeaves[leafCount-1].first];
+            int Llen = LPG->size(), Rlen = RPG->size();
+
+            if(Llen + Rlen <= maxLeafRows) {
+                memcpy(LPG->getLeafRowByteOffset(Llen), RPG->getLeafRowByteOffset(0), Rlen * ROW_SIZE);
+                LPG->setNumRows(Llen + Rlen);
+                LPG->setNext(-1);
+                releasePage(vacuumLeaves[leafCount-1].first);
+                vacuumLeaves.pop_back();
+                vacuumLeaves.back().second = vacuumLastKey;
+            }
+            else {
+                int moved = (Llen + Rlen) / 2 - Rlen;
+                memmove(RPG->getLeafRowByteOffset(moved), RPG->getLeafRowByteOffset(0), Rlen * ROW_SIZE);
+                memcpy(RPG->getLeafRowByteOffset(0), LPG->getLeafRowByteOffset(Llen - moved), moved * ROW_SIZE);
+                RPG->setNumRows(Rlen + moved);
+                LPG->setNumRows(Llen - moved);
+                vacuumLeaves[leafCount-2].second = LPG->getLeafKey(Llen - moved - 1);
+            }
+        }
+
+        // Make sure the internal levels fit before touching anything
+        int needed = 0, target = vacuumInternalTarget();
+        for(int n = vacuumLeaves.size(); n > 1; ) {
+            n = (n + target - 1) / target;
+            needed += n;
+        }
+        if(freeCount + (int)MAX_PAGES - page_count < needed) {
+            vacuumAbort();
+            return;
+        }
+
+        // Build the internal levels bottom up. Every separator is the largest key of the subtree on its left.
+        vector<uint8_t> live(MAX_PAGES, 0);
+        vector<pair<int32_t, Key>> level = vacuumLeaves;
+        for(auto &node : level) {
+            live[node.first] = 1;
+        }
+        while(level.size() > 1) {
+            int n = level.size();
+            int nodes = (n + target - 1) / target;
+
+            // Fill every node to the target and even out the last one with its neighbour, as for the leaves
+            vector<int> childCount(nodes, target);
+            childCount[nodes-1] = n - (nodes-1) * target;
+            int minChildren = minInternalKeys + 1, maxChildren = maxInternalKeys + 1;
+            if(nodes >= 2 && childCount[nodes-1] < minChildren) {
+                int total = childCount[nodes-2] + childCount[nodes-1];
+                if(total <= maxChildren) {
+                    childCount.pop_back();
+                    childCount.back() = total;
+                    --nodes;
+                }
+                else {
+                    childCount[nodes-2] = (total + 1) / 2;
+                    childCount[nodes-1] = total / 2;
+                }
+            }
+
+            vector<pair<int32_t, Key>> parentLevel;
+            int child = 0;
+            for(int k=0;k<nodes;++k) {
+                int children = childCount[k];
+                int preferred = parentLevel.empty() ? level.back().first + 1 : parentLevel.back().first + 1;
+                int pageNumber = allocatePage(preferred);
+                PageNode* pg = pages[pageNumber];
+                live[pageNumber] = 1;
+
+                int len = 0;
+                for(int c=0;c<children;++c,++child) {
+                    if(c > 0) pg->setInternalKey(len++, level[child-1].second);
+                    pg->setInternalPointer(len++, level[child].first);
+                    pages[level[child].first]->setParent(pageNumber);
+                }
+                pg->setNumRows(len);
+                parentLevel.push_back({pageNumber, level[child-1].second});
+            }
+            level = parentLevel;
+        }
+
+        // The root is looked up from page 0 when the file is opened, so the new root is moved there
+        loadPage(0);
+        PageNode* rootPage = pages[0];
+        if(level.empty()) {
+            rootPage->reset();
+            rootPage->initializeLeafNode();
+        }
+        else {
+            int newRoot = level[0].first;
+            memcpy(rootPage->page, pages[newRoot]->page, pageSize);
+            rootPage->setParent(-1);
+            if(!rootPage->isLeaf()) {
+                int len = rootPage->size();
+                for(int i=0;i<len;i+=2) {
+                    pages[rootPage->getInternalPointer(i)]->setParent(0);
+                }
+            }
+            live[newRoot] = 0;
+        }
+        live[0] = 1;
+
+        // Everything else, including pages retired by earlier merges, is free now
+        for(int i=0;i<page_count;++i) {
+            if(!live[i] && !freePage[i])
+                releasePage(i);
+        }
+
+        root = 0;
+        ++shapeVersion;
+        lastLeaf = -1;
+        vacuumLeaves.clear();
+        vacuumActive = false;
+    }
+
     int close() {
+        TRACE_SPAN("checkpoint");
+        // Frames are released below, so every pointer to them has to be turned back into a page number first
+        for(auto p : pages) {
+            if(p != nullptr) p->unswizzle();
+        }
         for(int i = 0; i < MAX_PAGES ; ++i) {
             auto &p = pages[i];
             if(p == nullptr) continue;
 
-            fd.seekp(i * PAGE_SIZE);
-            fd.write((char*)(p->page), PAGE_SIZE);
+            {
+                TRACE_SPAN("disk write");
+                fd.seekp(dataOffset + (int64_t)i * pageSize);
+                fd.write((char*)(p->page), pageSize);
+            }
             operator delete(p->page);
             delete p;
             cout << "Page " << i << "\n";
@@ -695,15 +2205,20 @@ public:
     }
 };
 
+using UserTable = Table<UserSchema>;
 
 
 
 
 
 
-int doMetaCommand(Table* table, vector<string> &inputCommand) {
+
+int doMetaCommand(UserTable* table, vector<string> &inputCommand) {
     if(inputCommand[0] == ".exit") {
         table->close();
+#ifdef DB2_TRACE
+        dumpTrace(table->filename + ".trace.json");
+#endif
         exit(0);
     }
     return 1;
@@ -723,16 +2238,16 @@ int prepareStatement(vector<string> &inputCommand, Row& row) {
     return 1;
 }
 
-int executeSelect(Table* table) {
+int executeSelect(UserTable* table) {
     return 0;
 }
 
-int executeInsert(Table* table, Row& row) {
+int executeInsert(UserTable* table, Row& row) {
     // table->insert(row);
     return 0;
 }
 
-int executeStatement(Table* table, vector<string> &inputCommand, Row& row) {
+int executeStatement(UserTable* table, vector<string> &inputCommand, Row& row) {
     if(inputCommand[0] == "insert") {
         return executeInsert(table, row);
     }
@@ -775,10 +2290,13 @@ int main(int argc, char* argv[]) {
         exit(1);
     }
     char* filename = argv[1];
+    // Page size for a new file; an existing file keeps the one it was created with
+    uint32_t pageSize = argc > 2 ? atoi(argv[2]) : DEFAULT_PAGE_SIZE;
+    bool bufferedWrites = argc > 3 && string(argv[3]) == "buffered";
 
-    Table* table = new Table(filename);
+    UserTable* table = new UserTable(filename, pageSize, bufferedWrites);
 
-    printConstants();
+    printConstants<UserSchema>(table->pageSize, table->bufferedWrites);
 
 
 
@@ -819,6 +2337,10 @@ int main(int argc, char* argv[]) {
     delete table;
     table = nullptr;
 
+#ifdef DB2_TRACE
+    dumpTrace(string(filename) + ".trace.json");
+#endif
+
     // string rawInputString;
     // while(true) {
     //     cout << "db2 > ";